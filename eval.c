@@ -1,5 +1,6 @@
 // eval.c
 // gcc eval.c -lm -o eval
+// (build with -DEVAL_NO_MAIN to link eval_legacy into another program)
 // Recursive-descent parser + evaluator following specified grammar and precedence
 
 #include <stdio.h>
@@ -37,13 +38,26 @@ static Token tlist_peek(TokenList *t) { if (t->idx < t->sz) return t->arr[t->idx
 static Token tlist_next(TokenList *t) { if (t->idx < t->sz) return t->arr[t->idx++]; Token eof = {T_EOF,NULL,0}; return eof; }
 static void tlist_free(TokenList *t) { for (int i=0;i<t->sz;i++) if (t->arr[i].text) free(t->arr[i].text); free(t->arr); }
 
-// RT map (simple vector)
-typedef struct { int id; double val; } RtEntry;
-typedef struct { RtEntry *arr; int sz; int cap; } RtMap;
-static void rt_init(RtMap *m) { m->sz=0; m->cap=16; m->arr=malloc(sizeof(RtEntry)*m->cap); }
-static void rt_set(RtMap *m, int id, double v) { for (int i=0;i<m->sz;i++) if (m->arr[i].id==id) { m->arr[i].val=v; return; } if (m->sz==m->cap) { m->cap*=2; m->arr=realloc(m->arr,sizeof(RtEntry)*m->cap); } m->arr[m->sz].id=id; m->arr[m->sz].val=v; m->sz++; }
-static double rt_get(RtMap *m, int id) { for (int i=0;i<m->sz;i++) if (m->arr[i].id==id) return m->arr[i].val; return 0.0; }
-static void rt_free(RtMap *m) { free(m->arr); }
+// RT map: dense slots plus an open-addressing id -> slot index (slot+1, 0 = empty), O(1) get/set
+typedef struct { int *ids; double *vals; int sz; int cap; int *index; int icap; } RtMap;
+static unsigned rt_hash(int id) { return (unsigned)id * 2654435761u; }
+static void rt_reserve(RtMap *m, int n) {
+    if (n > m->cap) { m->cap = n; m->ids = realloc(m->ids, sizeof(int)*m->cap); m->vals = realloc(m->vals, sizeof(double)*m->cap); }
+    if (n*2 <= m->icap) return;
+    int icap = 16; while (icap < n*2) icap *= 2;
+    free(m->index); m->index = calloc(icap, sizeof(int)); m->icap = icap;
+    for (int s=0;s<m->sz;s++) { unsigned h = rt_hash(m->ids[s]) & (icap-1); while (m->index[h]) h = (h+1) & (icap-1); m->index[h] = s+1; }
+}
+static void rt_init(RtMap *m) { m->sz=0; m->cap=0; m->icap=0; m->ids=NULL; m->vals=NULL; m->index=NULL; rt_reserve(m, 16); }
+static int rt_find(RtMap *m, int id) { unsigned h = rt_hash(id) & (m->icap-1); int s; while ((s = m->index[h]) != 0) { if (m->ids[s-1]==id) return s-1; h = (h+1) & (m->icap-1); } return -1; }
+static void rt_set(RtMap *m, int id, double v) {
+    int s = rt_find(m, id); if (s >= 0) { m->vals[s] = v; return; }
+    if (m->sz == m->cap) rt_reserve(m, m->cap*2);
+    s = m->sz++; m->ids[s] = id; m->vals[s] = v;
+    unsigned h = rt_hash(id) & (m->icap-1); while (m->index[h]) h = (h+1) & (m->icap-1); m->index[h] = s+1;
+}
+static double rt_get(RtMap *m, int id) { int s = rt_find(m, id); return s >= 0 ? m->vals[s] : 0.0; }
+static void rt_free(RtMap *m) { free(m->ids); free(m->vals); free(m->index); }
 
 // Tokenizer
 static void tokenize(const char *s, TokenList *out) {
@@ -277,6 +291,19 @@ static double parse_primary(TokenList *toks, RtMap *rt) {
     fprintf(stderr,"Unexpected token in primary\n"); exit(1);
 }
 
+// Embedding entry (used by eval_bench.c): one statement against a store kept across calls.
+// The text must be valid; errors exit like the REPL does.
+static RtMap s_legacyRt; static int s_legacyInit;
+void eval_legacy_set(int id, double v) { if (!s_legacyInit) { rt_init(&s_legacyRt); s_legacyInit=1; } rt_set(&s_legacyRt, id, v); }
+double eval_legacy(const char *s) {
+    if (!s_legacyInit) { rt_init(&s_legacyRt); s_legacyInit=1; }
+    TokenList toks; tlist_init(&toks); tokenize(s, &toks); toks.idx = 0;
+    double r = parse_assign(&toks, &s_legacyRt);
+    tlist_free(&toks); return r;
+}
+void eval_legacy_free(void) { if (s_legacyInit) { rt_free(&s_legacyRt); s_legacyInit=0; } }
+
+#ifndef EVAL_NO_MAIN
 int main(void) {
     char buf[4096];
     RtMap rt; rt_init(&rt);
@@ -307,3 +334,4 @@ int main(void) {
     rt_free(&rt);
     return 0;
 }
+#endif
@@ -0,0 +1,217 @@
+// eval_ast.h
+// Public interface of eval_ast.c: realtime point store and compiled expressions.
+// build: gcc -O2 eval_ast.c <your sources> -lm -lpthread -ldl
+// A formula is compiled once (tokenize, parse, optimize, lower to bytecode) and
+// can then be evaluated any number of times without parsing or allocation.
+
+#ifndef EVAL_AST_H
+#define EVAL_AST_H
+
+typedef struct RtMap RtMap;
+typedef struct CompiledExpr CompiledExpr;
+typedef struct DepGraph DepGraph;
+typedef struct EvalPool EvalPool;
+typedef struct RtShared RtShared;
+typedef struct CseTable CseTable;
+typedef struct AotModule AotModule;
+typedef struct ExprCache ExprCache;
+typedef struct ExprImage ExprImage;
+
+// Errors never end the process. A formula that does not compile comes back as NULL
+// with an EvalError; an evaluation that fails (division by zero) yields NaN and
+// leaves its error for eval_last_error on the same thread.
+enum {
+    EVAL_OK = 0,
+    EVAL_ERR_LEX,       // character the tokenizer does not know
+    EVAL_ERR_SYNTAX,
+    EVAL_ERR_DIV_ZERO,
+    EVAL_ERR_FUNC,      // call the evaluator cannot dispatch
+};
+
+typedef struct {
+    int code;           // EVAL_OK or EVAL_ERR_*
+    int pos;            // offset in the formula text
+    char msg[96];
+} EvalError;
+
+// First runtime error on this thread since the last call (EVAL_OK if none); clears it.
+// err may be NULL.
+int eval_last_error(EvalError* err);
+
+// Print err to stderr with a caret under its position in text (text may be NULL)
+void eval_report(const char* text, const EvalError* err);
+
+// realtime point store (#id -> value)
+RtMap* rt_create(int cap);
+void rt_destroy(RtMap* m);
+void rt_set(RtMap* m, int id, double v);
+double rt_get(RtMap* m, int id);
+void rt_preload(RtMap* m, const int* ids, const double* vals, int n);
+
+// History for the windowed builtins: rt_track keeps the last capacity samples of #id
+// (rounded up to a power of two, at least 2), each stamped with the wall clock in seconds
+// by rt_set, or with t by rt_set_at (timestamps must not decrease). Call it before
+// formulas over the point are evaluated.
+// Formulas read the history with delta(#id) (latest sample minus the one before) and,
+// over the samples newer than span seconds before the latest one, wavg(#id, span),
+// wmin(#id, span), wmax(#id, span) and rate(#id, span) (change per second); span is a
+// positive constant. Points without history, and batches, give NaN. Writes made by
+// formulas and through RtShared are not recorded.
+void rt_track(RtMap* m, int id, int capacity);
+void rt_set_at(RtMap* m, int id, double v, double t);
+
+// Optimizer mode for statements compiled afterwards (any thread may set it). Off (the
+// default), algebraic rewrites never change a result. On, they may: x + 0 becomes x and
+// x * 0 becomes 0, constants are reassociated ((#1 + 2) + 3 -> #1 + 5), x / c becomes
+// x * (1 / c), pow(x, 3|4) expands. No rewrite drops or repeats an assignment or a division.
+void eval_set_fast_math(int on);
+
+// Compile one statement, e.g. "#200 = #101 * #102 + #103".
+// min, max, sum and avg take any number of arguments (at least one), e.g. "sum(#1, #2, #3)".
+// Returns NULL (after reporting the error on stderr) if the text does not parse.
+CompiledExpr* expr_compile(const char* text, RtMap* rt);
+
+// Same, but a failure is only stored in err (may be NULL), nothing is printed
+CompiledExpr* expr_compile_ex(const char* text, RtMap* rt, EvalError* err);
+
+// Evaluate against rt; the handle rebinds itself if rt differs from the store it was compiled for
+double expr_eval(CompiledExpr* ce, RtMap* rt);
+
+// A formula evaluated more than n times (expr_eval, dep_recompute, pool_run) is compiled
+// to native code on x86-64 hosts; elsewhere it stays interpreted. n <= 0 turns the JIT off.
+// Default 100. Build with -DEVAL_NO_JIT to leave it out.
+void eval_set_jit_threshold(int n);
+
+// Evaluate ce over nrows sample rows given as columns: cols[k][row] is the value of #ids[k].
+// Ids without a column read 0.0; the store is neither read nor written. Results go to out[nrows].
+// A division by zero makes that quotient NaN in its row and is reported through eval_last_error,
+// unless && or || leaves that side unevaluated in the row (as expr_eval would).
+void expr_eval_batch(CompiledExpr* ce, const int* ids, const double* const* cols, int ncols, int nrows, double* out);
+
+// Same with flags. EVAL_BATCH_VECMATH evaluates sin, cos, exp, ln/log, log10, sqrt, tanh
+// and atan2 with vector kernels, within 3 ulp of libm (see eval_ast.c). Built with -mavx2
+// they run 2x to 6.6x faster than libm. A default (SSE2) build gains 1.2x to 3x and leaves
+// exp and ln/log to libm. Without the flag every call goes to libm. The kernels need a
+// GCC-compatible compiler.
+enum {
+    EVAL_BATCH_VECMATH = 1,
+};
+
+void expr_eval_batch_ex(CompiledExpr* ce, const int* ids, const double* const* cols, int ncols, int nrows, double* out, int flags);
+
+// Drops the caller's reference; the handle is freed with the last one
+void expr_release(CompiledExpr* ce);
+
+// Compile cache keyed by the token stream (whitespace does not matter), the fast-math
+// mode and the store. cache_compile returns a handle shared by every caller that compiled
+// the same statement for the same store: one reference each, expr_release when done.
+// Evaluate it against that store only (another one rebinds the shared handle). A shared
+// handle is one formula, so add it to a graph or CSE table once. capacity bounds the
+// number of entries, least recently used first out; 0 means unbounded (entries of
+// destroyed stores then stay until cache_destroy). The cache may be used from several
+// threads.
+ExprCache* cache_create(int capacity);
+CompiledExpr* cache_compile(ExprCache* c, const char* text, RtMap* rt, EvalError* err);
+void cache_stats(ExprCache* c, long* hits, long* misses, int* entries);
+void cache_destroy(ExprCache* c);
+
+// Repeated subexpressions inside one formula are always computed once per evaluation.
+// A CseTable extends that across formulas over the same store: cse_attach the formulas
+// (the table does not take ownership; release them only after cse_destroy), then
+// cse_compile. A subtree common to several formulas is then computed once per cycle;
+// cse_cycle starts a new cycle and must be called whenever input points change.
+// Points written by attached formulas invalidate the cached values that read them.
+// A table holds state shared by its formulas, so they are evaluated by one thread at a
+// time (pool_run runs such a graph on the calling thread).
+CseTable* cse_create(void);
+void cse_attach(CseTable* t, CompiledExpr* ce);
+void cse_compile(CseTable* t);
+void cse_cycle(CseTable* t);
+void cse_destroy(CseTable* t);
+
+// AOT mode for a fixed formula set. aot_write emits one C file with a function per
+// formula (in array order); build it as a shared object with the command in its header
+// and aot_load it on startup: no parsing at all. aot_eval(m, i, rt) evaluates formula i
+// against rt (binding to a new store on first use). aot_write returns -1 on error.
+// Pass aot_load a path containing a '/', otherwise dlopen searches the library path.
+int aot_write(const char* path, CompiledExpr* const* exprs, int n);
+AotModule* aot_load(const char* path, RtMap* rt);
+int aot_count(AotModule* m);
+double aot_eval(AotModule* m, int i, RtMap* rt);
+void aot_close(AotModule* m);
+
+// Compiled images: image_write saves the optimized trees of n formulas to one binary
+// file (host byte order, checked on open). image_open maps it read-only, shared by every
+// process that opens it; image_load(img, i, rt) makes a handle for formula i without
+// going through the text front end (release it as usual). The image may be closed
+// while handles loaded from it are alive. Errors are reported on stderr.
+int image_write(const char* path, CompiledExpr* const* exprs, int n);
+ExprImage* image_open(const char* path);
+int image_count(ExprImage* img);
+CompiledExpr* image_load(ExprImage* img, int i, RtMap* rt);
+void image_close(ExprImage* img);
+
+// Dependency graph over formulas that share a store. dep_add registers a compiled
+// formula (the graph does not take ownership) and returns its index. dep_build
+// orders the formulas topologically; it returns -1 and reports the points involved
+// if the formulas form a cycle. dep_update sets a point and marks the formulas
+// reading it; dep_recompute re-evaluates only marked formulas, downstream first-to-last,
+// and returns how many ran. The first dep_recompute after dep_build runs everything.
+DepGraph* dep_create(RtMap* rt);
+int dep_add(DepGraph* g, CompiledExpr* ce);
+int dep_build(DepGraph* g);
+void dep_update(DepGraph* g, int id, double v);
+int dep_recompute(DepGraph* g);
+double dep_result(DepGraph* g, int f);
+void dep_destroy(DepGraph* g);
+
+// Work-stealing thread pool; nthreads counts the calling thread, which joins in.
+// pool_run evaluates every formula of a built graph once, each formula only after
+// all formulas it depends on, and returns how many ran (0 if g needs dep_build).
+EvalPool* pool_create(int nthreads);
+int pool_run(EvalPool* pool, DepGraph* g);
+void pool_destroy(EvalPool* pool);
+
+// Store shared between writer threads and lock-free readers. Writers call rts_set or
+// rts_set_many (one epoch for the whole batch). Each reader thread owns a view from
+// rts_view; rts_snapshot copies a consistent epoch into it without locking and returns
+// the epoch. Formulas from rts_compile evaluate against any view with expr_eval once
+// the view has been snapshotted after the compile (before that: NaN, EVAL_ERR_FUNC).
+// Writes a formula makes (N_ASSIGN) land in the reader's view only.
+RtShared* rts_create(int cap);
+void rts_destroy(RtShared* s);
+void rts_set(RtShared* s, int id, double v);
+void rts_set_many(RtShared* s, const int* ids, const double* vals, int n);
+RtMap* rts_view(RtShared* s);
+unsigned rts_snapshot(RtShared* s, RtMap* view);
+CompiledExpr* rts_compile(RtShared* s, const char* text);
+
+// Profiling, compiled in with -DEVAL_PROFILE (otherwise expr_profile returns 0 and
+// the rest does nothing): every evaluation of a formula is timed. Times are cycle
+// counter ticks on x86, nanoseconds elsewhere; percentiles are bucket upper bounds,
+// within 25%.
+typedef struct {
+    unsigned long long evals;
+    unsigned long long total;
+    unsigned long long worst;
+    unsigned long long p50;
+    unsigned long long p90;
+    unsigned long long p99;
+} ExprProfile;
+
+int expr_profile(CompiledExpr* ce, ExprProfile* out);
+
+// Print the top formulas by total time (top <= 0: all) and the op mix to stdout
+void eval_profile_dump(int top);
+void eval_profile_reset(void);
+
+// Streaming mode for replaying statement logs: evaluates every line of inPath (NULL:
+// stdin) against rt and writes one result per non-blank line to outPath (NULL: stdout),
+// NaN for lines that fail (the error goes to stderr with the line number). Lines may be
+// of any length. Returns the number of statements evaluated, -1 on an I/O error.
+long eval_stream(const char* inPath, const char* outPath, RtMap* rt);
+
+// interactive read-eval-print loop on stdin; the line .profile prints the profile
+void eval_main(void);
+
+#endif
@@ -0,0 +1,487 @@
+// eval_bench.c
+// gcc -O2 -DEVAL_NO_MAIN eval_bench.c eval.c -lm -lpthread -o eval_bench
+// Per-stage timings for the AST evaluator (tokenize, parse_assign, optimize_ast,
+// eval_node, compiled bytecode) over a corpus of representative formulas, plus
+// the legacy direct evaluator of eval.c for comparison, then the batch vector math
+// kernels against libm (time per value and largest error in ulp) and the windowed
+// builtins over a tracked point (time per recorded sample and per evaluation).
+// A few statements with known results are checked first; a failure ends the run.
+// eval_ast.c is included directly so its static stages can be timed one by one.
+// Usage: eval_bench [iterations]
+
+#define EVAL_BENCH      // keeps the bench-only evaluators of eval_ast.c
+#include "eval_ast.c"
+
+#include <time.h>
+
+// eval.c
+double eval_legacy(const char* s);
+void eval_legacy_set(int id, double v);
+void eval_legacy_free(void);
+
+/**************************************
+ * Allocation counting
+ * With glibc the allocator entry points are wrapped so every stage can report
+ * allocations per operation. Elsewhere the column reads "-".
+ **************************************/
+static long s_allocs;
+
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+extern void* __libc_malloc(size_t n);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t n);
+
+void* malloc(size_t n)
+{
+    s_allocs++;
+    return __libc_malloc(n);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    s_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t n)
+{
+    s_allocs++;
+    return __libc_realloc(p, n);
+}
+#else
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+/**************************************
+ * Corpus
+ **************************************/
+typedef struct {
+    const char* name;
+    const char* text;
+    int legacy;     // also valid for eval.c (which only knows exp, sin and cos)
+} BenchCase;
+
+static const BenchCase s_corpus[] = {
+    { "short", "#1 + 2 * #2 - 3", 1 },
+    { "nested", "((((#1 + 1) * 2 - 3) / 4 + ((#2 - 5) * (#3 + 6))) * (((#1 * #2) - (#3 / 7)) + 8)) / ((#4 + 1) * (#5 + 2))", 1 },
+    { "builtins", "sqrt(#1 * #1 + #2 * #2) + pow(#3, 2) + sin(#1) * cos(#2) + exp(#3 / 10) + abs(#4) + log(#5 + 1) + ncr(10, 3)", 0 },
+    { "trig", "exp(sin(#1) + cos(#2)) * sin(#3 * 0.5) - cos(exp(#4 / 100))", 1 },
+    { "many_ids", "#101 + #102 + #103 + #104 + #105 + #106 + #107 + #108 + #109 + #110 + #111 + #112 + #113 + #114 + #115 + #116"
+                  " + #117 + #118 + #119 + #120 + #121 + #122 + #123 + #124 + #125 + #126 + #127 + #128 + #129 + #130 + #131 + #132", 1 },
+    { "logical", "#1 > 0 && #2 < 10 || #3 == 5 && !(#4 != 2) || #5 >= 1 && #6 <= 3 || (#7 & 4) != 0 && #8 << 2 > 16", 1 },
+    { "assign", "#200 = #1 * 0.5 + #2 * 0.25 + #3 * 0.125", 1 },
+    { "aggregate", "avg(#101, #102, #103, #104, #105, #106, #107, #108, #109, #110, #111, #112, #113, #114, #115, #116)"
+                   " + max(#1, #2, #3, #4) - min(#5, #6, #7)", 0 },
+};
+
+/**************************************
+ * Checks
+ * Statements with known results, run through expr_eval before anything is timed.
+ * #1 holds in before the statement and must hold point afterwards; results are
+ * compared to 12 significant digits.
+ **************************************/
+typedef struct {
+    const char* text;
+    double in;
+    double want;
+    double point;
+} BenchCheck;
+
+static const BenchCheck s_checks[] = {
+    // integer combinatorics past 2^53, where n - r rounds to n
+    { "npr(#1, 3)", 1e19, 1e57, 1e19 },
+    { "ncr(100000000000000000, 3)", 0, 1.6666666666666666e50, 0 },
+    { "ncr(1000000000000000000, 2)", 0, 5e35, 0 },
+    { "npr(100000000000000000, 3)", 0, 1e51, 0 },
+    { "ncr(9007199254740991, 2)", 0, 4.0564819207303327e31, 0 },
+    { "ncr(100, 50)", 0, 1.0089134454556419e29, 0 },
+    { "npr(1000, 3)", 0, 997002000, 0 },
+    // the optimizer must neither drop nor repeat an assignment
+    { "pow(#1 = #1 + 1, 2)", 3, 16, 4 },
+    { "pow(#1 = #1 + 1, 0)", 3, 1, 4 },
+};
+
+static int bench_checks(void)
+{
+    RtMap* rt = rt_create(16);
+    int failed = 0;
+    int count = (int)(sizeof(s_checks) / sizeof(s_checks[0]));
+    for (int i = 0; i < count; i++)
+    {
+        const BenchCheck* k = &s_checks[i];
+        rt_set(rt, 1, k->in);
+        CompiledExpr* ce = expr_compile(k->text, rt);
+        double got = ce ? expr_eval(ce, rt) : NAN;
+        double point = rt_get(rt, 1);
+        if (!(got == k->want || fabs(got - k->want) <= 1e-12 * fabs(k->want)) || point != k->point)
+        {
+            printf("check failed: %s with #1 = %.17g gives %.17g and #1 = %.17g, want %.17g and %.17g\n",
+                k->text, k->in, got, point, k->want, k->point);
+            failed++;
+        }
+        expr_release(ce);
+    }
+
+    rt_destroy(rt);
+    return failed;
+}
+
+/**************************************
+ * Measurement
+ **************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+    double ns;
+    double allocs;
+} Stage;
+
+static volatile double s_sink;  // keeps results alive
+
+static void print_stage(const char* stage, Stage st)
+{
+    if (BENCH_COUNT_ALLOCS)
+        printf("  %-14s %10.1f ns/op %8.2f allocs/op\n", stage, st.ns, st.allocs);
+    else
+        printf("  %-14s %10.1f ns/op %8s allocs/op\n", stage, st.ns, "-");
+}
+
+static Stage bench_tokenize(const char* text, int iters)
+{
+    int len = (int)strlen(text);
+    long a0 = s_allocs;
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        Arena arena = { 0 };
+        TokenList toks;
+        tlist_init(&toks, &arena);
+        tokenize(text, len, &toks);
+        s_sink = toks.sz;
+        arena_free(&arena);
+    }
+
+    Stage st = { (now_ns() - t0) / iters, (double)(s_allocs - a0) / iters };
+    return st;
+}
+
+static Stage bench_parse(const char* text, int iters)
+{
+    Arena tokArena = { 0 };
+    TokenList toks;
+    tlist_init(&toks, &tokArena);
+    tokenize(text, (int)strlen(text), &toks);
+
+    long a0 = s_allocs;
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        Arena arena = { 0 };
+        toks.idx = 0;
+        toks.arena = &arena;
+        s_sink = parse_assign(&toks)->type;
+        arena_free(&arena);
+    }
+
+    Stage st = { (now_ns() - t0) / iters, (double)(s_allocs - a0) / iters };
+    arena_free(&tokArena);
+    return st;
+}
+
+// optimize_ast rewrites the tree in place, so every iteration gets its own copy
+static Stage bench_optimize(const char* text, int iters)
+{
+    enum { BATCH = 256 };
+    Node* trees[BATCH];
+    double ns = 0;
+    long allocs = 0;
+    for (int done = 0; done < iters; done += BATCH)
+    {
+        int n = iters - done < BATCH ? iters - done : BATCH;
+        Arena arena = { 0 };
+        for (int i = 0; i < n; i++)
+        {
+            trees[i] = parse_text(text, &arena, NULL);
+        }
+
+        long a0 = s_allocs;
+        double t0 = now_ns();
+        for (int i = 0; i < n; i++)
+        {
+            s_sink = optimize_ast(trees[i], &arena, 0)->type;
+        }
+
+        ns += now_ns() - t0;
+        allocs += s_allocs - a0;
+        arena_free(&arena);
+    }
+
+    Stage st = { ns / iters, (double)allocs / iters };
+    return st;
+}
+
+static Stage bench_eval_node(Node* ast, RtMap* rt, int iters)
+{
+    long a0 = s_allocs;
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        s_sink = eval_node(ast, rt);
+    }
+
+    Stage st = { (now_ns() - t0) / iters, (double)(s_allocs - a0) / iters };
+    return st;
+}
+
+static Stage bench_vm(CompiledExpr* ce, RtMap* rt, int iters)
+{
+    long a0 = s_allocs;
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        s_sink = expr_eval(ce, rt);
+    }
+
+    Stage st = { (now_ns() - t0) / iters, (double)(s_allocs - a0) / iters };
+    return st;
+}
+
+static Stage bench_legacy(const char* text, int iters)
+{
+    long a0 = s_allocs;
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        s_sink = eval_legacy(text);
+    }
+
+    Stage st = { (now_ns() - t0) / iters, (double)(s_allocs - a0) / iters };
+    return st;
+}
+
+/**************************************
+ * Vector math kernels against libm
+ **************************************/
+#if EVAL_SIMD
+typedef struct {
+    const char* name;
+    double (*f1)(double);
+    double (*f2)(double, double);
+    VecKernel1 k1;
+    VecKernel2 k2;
+    double lo;      // sample range; with logScale the values are e^[lo, hi)
+    double hi;
+    int logScale;
+} VecCase;
+
+static const VecCase s_vecCases[] = {
+    { "sin", sin, NULL, vec_sin, NULL, -1e5, 1e5, 0 },
+    { "cos", cos, NULL, vec_cos, NULL, -1e5, 1e5, 0 },
+    { "exp", exp, NULL, vec_exp, NULL, -708, 709, 0 },
+    { "log", log, NULL, vec_log, NULL, -700, 700, 1 },
+    { "log10", log10, NULL, vec_log10, NULL, -700, 700, 1 },
+    { "sqrt", sqrt, NULL, vec_sqrt, NULL, 0, 1e6, 0 },
+    { "tanh", tanh, NULL, vec_tanh, NULL, -25, 25, 0 },
+    { "atan2", NULL, atan2, NULL, vec_atan2, -10, 10, 0 },
+};
+
+static uint64_t s_rng = 0x9E3779B97F4A7C15ull;
+
+static double bench_random(double lo, double hi, int logScale)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 7;
+    s_rng ^= s_rng << 17;
+    double u = lo + (hi - lo) * (double)(s_rng >> 11) / 9007199254740992.0;
+    return logScale ? exp(u) : u;
+}
+
+// Distance in representable doubles
+static double ulp_diff(double a, double b)
+{
+    if (isnan(a) || isnan(b))
+        return isnan(a) && isnan(b) ? 0.0 : INFINITY;
+
+    int64_t x, y;
+    memcpy(&x, &a, sizeof(x));
+    memcpy(&y, &b, sizeof(y));
+    x = x < 0 ? INT64_MIN - x : x;
+    y = y < 0 ? INT64_MIN - y : y;
+    return x > y ? (double)((uint64_t)x - (uint64_t)y) : (double)((uint64_t)y - (uint64_t)x);
+}
+
+static void bench_vecmath(void)
+{
+    enum { N = 4096, PASSES = 500, SAMPLES = 1 << 22 };
+    static double a[N], b[N], out[N];
+
+    printf("\nvector math kernels, %d lanes: libm and kernel time per value, largest error over %d samples\n",
+        VEC_LANES, SAMPLES);
+    for (size_t c = 0; c < sizeof(s_vecCases) / sizeof(s_vecCases[0]); c++)
+    {
+        const VecCase* vc = &s_vecCases[c];
+        double worst = 0;
+        for (int done = 0; done < SAMPLES; done += N)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                a[i] = bench_random(vc->lo, vc->hi, vc->logScale);
+                b[i] = bench_random(vc->lo, vc->hi, vc->logScale);
+            }
+
+            if (vc->k1)
+                vc->k1(a, out, N);
+            else
+                vc->k2(a, b, out, N);
+
+            for (int i = 0; i < N; i++)
+            {
+                double d = ulp_diff(out[i], vc->f1 ? vc->f1(a[i]) : vc->f2(a[i], b[i]));
+                worst = d > worst ? d : worst;
+            }
+        }
+
+        double t0 = now_ns();
+        for (int p = 0; p < PASSES; p++)
+        {
+            if (vc->f1)
+            {
+                for (int i = 0; i < N; i++)
+                    out[i] = vc->f1(a[i]);
+            }
+            else
+            {
+                for (int i = 0; i < N; i++)
+                    out[i] = vc->f2(a[i], b[i]);
+            }
+            s_sink = out[p % N];
+        }
+
+        double libm = (now_ns() - t0) / ((double)PASSES * N);
+        t0 = now_ns();
+        for (int p = 0; p < PASSES; p++)
+        {
+            if (vc->k1)
+                vc->k1(a, out, N);
+            else
+                vc->k2(a, b, out, N);
+            s_sink = out[p % N];
+        }
+
+        double vec = (now_ns() - t0) / ((double)PASSES * N);
+        printf("  %-8s %8.2f ns %8.2f ns %6.2fx %6.0f ulp\n", vc->name, libm, vec, libm / vec, worst);
+    }
+}
+#endif
+
+// Windowed builtins over one tracked point: recording a sample updates every window,
+// evaluating reads the running state whatever the window holds
+static void bench_windows(int iters)
+{
+    enum { CAP = 4096 };
+    RtMap* rt = rt_create(16);
+    rt_track(rt, 1, CAP);
+    CompiledExpr* ce = expr_compile("wavg(#1, 600) + wmax(#1, 600) - wmin(#1, 60) + rate(#1, 600)", rt);
+    double t = 0.0;
+    for (int i = 0; i < CAP; i++)
+    {
+        rt_set_at(rt, 1, (i * 7919 % 1000) * 0.1, t += 0.25);
+    }
+    expr_eval(ce, rt);      // the windows are created on first use
+
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        rt_set_at(rt, 1, (i * 7919 % 1000) * 0.1, t += 0.25);
+    }
+    double write = (now_ns() - t0) / iters;
+
+    t0 = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        s_sink = expr_eval(ce, rt);
+    }
+    double eval = (now_ns() - t0) / iters;
+
+    printf("\nwindowed builtins, %d samples of history, 2400 in the widest window\n", CAP);
+    printf("  rt_set_at %8.1f ns/op\n  expr_eval %8.1f ns/op\n", write, eval);
+    expr_release(ce);
+    rt_destroy(rt);
+}
+
+int main(int argc, char** argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 200000;
+    if (iters <= 0)
+    {
+        iters = 200000;
+    }
+
+    // the same point values in both stores; none of them is zero, so no formula divides by zero
+    RtMap* rt = rt_create(256);
+    for (int id = 1; id <= 132; id++)
+    {
+        rt_set(rt, id, 1.0 + id % 9);
+        eval_legacy_set(id, 1.0 + id % 9);
+    }
+
+    if (bench_checks())
+    {
+        return 1;
+    }
+
+    printf("eval_bench: %d iterations per stage\n", iters);
+    int count = (int)(sizeof(s_corpus) / sizeof(s_corpus[0]));
+    for (int c = 0; c < count; c++)
+    {
+        const BenchCase* bc = &s_corpus[c];
+        printf("\n[%s] %s\n", bc->name, bc->text);
+
+        Stage tok = bench_tokenize(bc->text, iters);
+        Stage parse = bench_parse(bc->text, iters);
+        Stage opt = bench_optimize(bc->text, iters);
+
+        Arena arena = { 0 };
+        Node* ast = optimize_ast(parse_text(bc->text, &arena, NULL), &arena, 0);
+        Stage eval = bench_eval_node(ast, rt, iters);
+        CompiledExpr* ce = expr_compile(bc->text, rt);
+        Stage vm = bench_vm(ce, rt, iters);
+        double expect = eval_node(ast, rt);
+
+        print_stage("tokenize", tok);
+        print_stage("parse_assign", parse);
+        print_stage("optimize_ast", opt);
+        print_stage("eval_node", eval);
+        Stage pipeline = { tok.ns + parse.ns + opt.ns + eval.ns, tok.allocs + parse.allocs + opt.allocs + eval.allocs };
+        print_stage("ast total", pipeline);
+        print_stage("bytecode", vm);
+
+        if (bc->legacy)
+        {
+            Stage legacy = bench_legacy(bc->text, iters);
+            print_stage("legacy eval.c", legacy);
+            double got = eval_legacy(bc->text);
+            printf("  legacy / ast total %.2fx, legacy / bytecode %.2fx%s\n",
+                legacy.ns / pipeline.ns, legacy.ns / vm.ns,
+                got == expect ? "" : "  (results differ)");
+        }
+
+        expr_release(ce);
+        arena_free(&arena);
+    }
+
+#if EVAL_SIMD
+    bench_vecmath();
+#endif
+    bench_windows(iters);
+
+    rt_destroy(rt);
+    eval_legacy_free();
+    return 0;
+}